@@ -27,6 +27,10 @@
 #ifndef __LANGID_H_INCLUDED
 #define __LANGID_H_INCLUDED
 
+#include <atomic>
+#ifndef FrSINGLE_THREADED
+#  include <mutex>
+#endif /* !FrSINGLE_THREADED */
 #include "mtrie.h"
 #include "ptrie.h"
 
@@ -37,7 +41,7 @@ using namespace std ;
 /************************************************************************/
 
 // current binary file format version
-#define LANGID_FILE_VERSION 6
+#define LANGID_FILE_VERSION 7
 #define LANGID_FILE_SIGNATURE "Language Identification Database\r\n\x1A\004\0"
 
 // minimum file version still supported
@@ -127,6 +131,7 @@ class TrigramCounts
 
       // modifiers
       void copy(const TrigramCounts *orig) ;
+      void add(const TrigramCounts *other) ;
       void clear(uint8_t c1, uint8_t c2, uint8_t c3)
 	 { m_counts[(c1 << 16) + (c2 << 8) + c3] = 0 ; }
       void incr(uint8_t c1, uint8_t c2, uint8_t c3, uint32_t cnt = 1)
@@ -262,19 +267,21 @@ class LanguageScores
 	 public:
 //	    Info() {}
 	    void init(double sc, unsigned short new_id)
-	       { m_score = sc ; m_id = new_id ; }
+	       { m_score = sc ; m_id = new_id ; m_touched = false ; }
 
 	    // accessors
 	    double score() const { return m_score ; }
 	    unsigned short id() const { return m_id ; }
+	    bool touched() const { return m_touched ; }
 
 	    // manipulators
 	    void setScore(double sc) { m_score = sc ; }
 	    void incrScore(double inc) { m_score += inc ; }
 	    void decrScore(double dec) { m_score -= dec ; }
 	    void setLang(unsigned short id) { m_id = id ; }
+	    void touch() { m_touched = true ; }
 	    Info& operator= (double sc) { m_score = sc ; return *this ; }
-	    Info& operator= (int id) { m_id = id ; m_score = 0.0 ; return *this ; }
+	    Info& operator= (int id) { m_id = id ; m_score = 0.0 ; m_touched = false ; return *this ; }
 
 	    static void swap(Info&, Info&) ;
 
@@ -286,6 +293,7 @@ class LanguageScores
 	 private:
 	    double   	   m_score ;
 	    unsigned short m_id ;
+	    bool	   m_touched ;	// fits in what would otherwise be padding
 	 } ;
       typedef Fr::ItemPoolFlat<Info>::iter_type iter_type ;
       typedef Fr::ItemPoolFlat<Info>::const_iter_type const_iter_type ;
@@ -298,8 +306,9 @@ class LanguageScores
       // accessors
       void *userData() const { return m_userdata ; }
       bool sorted() const { return m_sorted ; }
-      unsigned numLanguages() const { return m_info.size() ; }
-      unsigned maxLanguages() const { return m_info.capacity() ; }
+      bool sparse() const { return m_sparse ; }
+      unsigned numLanguages() const { return m_size ; }
+      unsigned maxLanguages() const { return m_info.size() ; }
       unsigned activeLanguage() const { return m_active_language ; }
       unsigned topLanguage() const { return m_info[0].id() ; }
       unsigned languageNumber(size_t N) const
@@ -314,15 +323,18 @@ class LanguageScores
       void setUserData(void *u) { m_userdata = u ; }
       void clear() ;
       void reserve(size_t N) ;
+      void useSparseScores(bool sparse = true) ;
+      void useScoreArray(bool use = true) ;
       void setScore(size_t N, double val)
-	 { if (N < numLanguages()) m_info[N].setScore(val) ; }
+	 { if (N < numLanguages()) { noteUpdate(N,val) ; m_info[N].setScore(val) ; } }
       void increment(size_t N, double incr = 1.0)
-	 { if (N < numLanguages()) m_info[N].incrScore(incr) ; }
+	 { if (N < numLanguages()) { noteUpdate(N,incr) ; m_info[N].incrScore(incr) ; } }
       void decrement(size_t N, double decr = 1.0)
-	 { if (N < numLanguages()) m_info[N].incrScore(-decr) ; }
+	 { if (N < numLanguages()) { noteUpdate(N,decr) ; m_info[N].incrScore(-decr) ; } }
       void scaleScore(size_t N, double scale_factor)
 	 { if (N < numLanguages()) m_info[N].setScore(m_info[N].score() * scale_factor) ; }
       void scaleScores(double scale_factor) ;
+      void scaleScoresByLanguage(const double *factors) ;
       void sqrtScores() ;
       void add(const LanguageScores *scores, double weight = 1.0) ;
       void addThresholded(const LanguageScores *scores, double threshold,
@@ -339,19 +351,45 @@ class LanguageScores
       void setLanguage(unsigned lang)
 	 { m_active_language = lang ; }
 
+      // support for sparse accumulation: the scorer appends the ID of
+      //   each language it touches for the first time to the touched list
+      unsigned short *touchedList() const { return m_sparse ? m_touched.begin() : nullptr ; }
+      unsigned numTouched() const { return m_numtouched ; }
+      void setNumTouched(unsigned N) { m_numtouched = N ; }
+
+      // support for structure-of-arrays accumulation: the scorer adds its
+      //   hits to a flat array indexed by language ID, which is then
+      //   merged into the records (and re-zeroed) in one pass
+      double *scoreArray() const { return m_score_array ; }
+      void mergeScoreArray() ;
+
       // iterator support
       iter_type begin() const { return m_info.begin() ; }
       const_iter_type cbegin() const { return m_info.cbegin() ; }
-      iter_type end() const { return m_info.end() ; }
-      const_iter_type cend() const { return m_info.cend() ; }
+      iter_type end() const { auto e = m_info.begin() ; e += m_size ; return e ; }
+      const_iter_type cend() const { auto e = m_info.cbegin() ; e += m_size ; return e ; }
    protected: // methods
       void sortByName(const LanguageID *langinfo) ;
+      bool trackingTouched() const { return m_sparse && m_touched_valid ; }
+      void noteUpdate(size_t N, double val)
+	 { if (m_sparse && val != 0.0 && !m_info[N].touched()) m_touched_valid = false ; }
+      void invalidateTouched() { m_touched_valid = m_touched_valid && m_compacted ; }
+      bool compactTouched() ;
+      void allocateScoreArray(size_t N) ;
 
    protected: // members
       Fr::ItemPoolFlat<Info> m_info ;
-      void*		 m_userdata ;
-      unsigned		 m_active_language ;
-      bool      	 m_sorted ;
+      Fr::NewPtr<unsigned short> m_touched ;	// IDs of languages with hits, in sparse mode
+      Fr::DoublePtr	 m_score_buffer ;	// storage for m_score_array
+      double*		 m_score_array { nullptr } ; // per-language accumulators, if enabled
+      void*		 m_userdata { nullptr } ;
+      size_t		 m_size { 0 } ;		// number of entries currently in use
+      unsigned		 m_numtouched { 0 } ;
+      unsigned		 m_active_language { 0 } ;
+      bool      	 m_sorted { false } ;
+      bool		 m_sparse { false } ;
+      bool		 m_touched_valid { true } ;	// touched list covers all nonzero scores
+      bool		 m_compacted { false } ;	// touched entries moved to front of m_info
    } ;
 
 //----------------------------------------------------------------------
@@ -378,6 +416,72 @@ class WeightedLanguageScores : public LanguageScores
       Fr::DoublePtr	m_weights ;
    } ;
 
+//----------------------------------------------------------------------
+// the per-caller state needed during identification; the
+//   LanguageIdentifier itself is not modified while identifying, so any
+//   number of threads may share it as long as each uses its own context
+
+class LanguageScoringContext
+   {
+   public:
+      LanguageScoringContext() = default ;
+      LanguageScoringContext(const LanguageScoringContext&) = delete ;
+      ~LanguageScoringContext() = default ;
+      LanguageScoringContext& operator= (const LanguageScoringContext&) = delete ;
+
+      // accessors
+      LanguageScores *priorScores() const { return m_prior_scores.get() ; }
+
+      // modifiers
+      void resetSmoothing() { m_prior_scores = nullptr ; }
+      LanguageScores *initPriorScores(size_t num_languages)
+	 { m_prior_scores.reinit(num_languages) ; return m_prior_scores.get() ; }
+      // a (sparse) score set which is reused from call to call
+      LanguageScores *scratchScores(size_t num_languages) ;
+
+   private:
+      Fr::Owned<LanguageScores> m_prior_scores { nullptr } ;
+      Fr::Owned<LanguageScores> m_scratch { nullptr } ;
+   } ;
+
+//----------------------------------------------------------------------
+// the input and output records for batch identification
+
+class LanguageSpan
+   {
+   public:
+      LanguageSpan() = default ;
+      LanguageSpan(const char *text, size_t length) : m_text(text), m_length(length) {}
+      ~LanguageSpan() = default ;
+
+      // accessors
+      const char *text() const { return m_text ; }
+      size_t length() const { return m_length ; }
+
+   private:
+      const char *m_text { nullptr } ;
+      size_t      m_length { 0 } ;
+   } ;
+
+class LanguageGuess
+   {
+   public:
+      static constexpr unsigned short no_language = (unsigned short)~0 ;
+   public:
+      LanguageGuess() = default ;
+      LanguageGuess(unsigned lang, double sc) : m_score(sc), m_language((unsigned short)lang) {}
+      ~LanguageGuess() = default ;
+
+      // accessors
+      bool known() const { return m_language != no_language ; }
+      unsigned language() const { return m_language ; }
+      double score() const { return m_score ; }
+
+   private:
+      double	     m_score { 0.0 } ;
+      unsigned short m_language { no_language } ;
+   } ;
+
 //----------------------------------------------------------------------
 
 class LanguageIdentifier
@@ -408,12 +512,18 @@ class LanguageIdentifier
       bool good() const { return m_langdata && m_langdata->good() ; }
       bool verbose() const { return m_verbose ; }
       bool smoothingScores() const { return m_smooth ; }
+      bool sparseScores() const { return m_sparse_scores ; }
+      bool scoreArrays() const { return m_score_arrays ; }
+      bool interleavedLookups() const { return m_interleave ; }
       bool applyCoverageFactor() const { return m_apply_cover_factor && m_adjustments ; }
       size_t allocLanguages() const { return m_langinfo.capacity() ; }
       size_t numLanguages() const { return m_langinfo.size() ; }
       double adjustmentFactor(size_t N) const { return m_adjustments[N] ; }
       LanguageIdentifier *charsetIdentifier() const { return m_charsetident ; }
       class LangIDPackedMultiTrie* trie() const { return m_langdata.get() ; }
+      const char *databaseResidency() const
+	 { return m_langdata ? m_langdata->residency() : "not loaded" ; }
+      const PackedTrieMatcher *matcher() const { return m_matcher.get() ; }
       LangIDPackedMultiTrie *packedTrie() ;
       class LangIDMultiTrie *unpackedTrie() ;
       const char *databaseLocation() const { return m_directory ; }
@@ -421,6 +531,15 @@ class LanguageIdentifier
       const char *friendlyName(size_t N) const ;
       const char *languageScript(size_t N) const ;
       const uint8_t *alignments() const { return m_alignments ; }
+      const uint8_t *alignments(bool enforce) const
+	 { return enforce ? m_alignments.get() : m_unaligned.get() ; }
+      const double *lengthFactors() const { return m_length_factors ; }
+      // mapped score times length factor for each frequency record, built
+      //   on first use; nullptr if they could not be built
+      const float *frequencyWeights() const ;
+      // whether scoring with the given alignment table must check each
+      //   language's alignment, or may use the faster unaligned kernels
+      bool alignmentCheckNeeded(const uint8_t *align) const ;
       Fr::CharPtr languageDescriptor(size_t N) const ;
       const char *languageEncoding(size_t N) const ;
       const char *languageSource(size_t N) const ;
@@ -446,7 +565,18 @@ class LanguageIdentifier
 			       bool enforce_alignments = true) const ;
       bool finishIdentification(LanguageScores *scores, unsigned select_highestN = 0,
 				double cutoff_ratio = 0.1) const ;
-      Fr::Owned<LanguageScores> smoothedScores(LanguageScores* rawscores, int buflen) const ;
+      // identify each of a batch of (typically short) spans, storing up to
+      //   'topN' guesses per span at results[i*topN] (unused entries are
+      //   !known()); returns the number of spans with at least one guess.
+      //   The trie walks of successive spans are interleaved with each
+      //   other, so this is much faster than calling identify() per span;
+      //   with useMatcher(), the spans are scored one at a time instead
+      size_t identifyBatch(LanguageScoringContext& context, const LanguageSpan *spans,
+			   size_t numspans, LanguageGuess *results, unsigned topN,
+			   double cutoff_ratio = 0.1, bool apply_stop_grams = true,
+			   bool enforce_alignments = true) const ;
+      Fr::Owned<LanguageScores> smoothedScores(LanguageScoringContext& context, LanguageScores* rawscores,
+					       int buflen) const ;
       Fr::Owned<LanguageScores> similarity(unsigned langid) const ;
       bool sameLanguage(size_t L1, size_t L2,
 			bool ignore_region = false) const ;
@@ -456,9 +586,22 @@ class LanguageIdentifier
       uint32_t addLanguage(const LanguageID &info, uint64_t train_bytes) ;
       void charsetIdentifier(LanguageIdentifier *id) 
 	 { m_charsetident = (id ? id : this) ; }
-      void setBigramWeight(double weight) { m_bigram_weight = weight ; }
+      void setBigramWeight(double weight) ;
       void useFriendlyName(bool friendly = true) { m_friendly_name = friendly ; }
       void smoothScores(bool sm = true) { m_smooth = sm ; }
+      // track only the languages actually hit instead of scanning all
+      //   of them; a win for short inputs and large model sets
+      void useSparseScores(bool sparse = true) { m_sparse_scores = sparse ; }
+      // accumulate into a flat per-language array of doubles rather than
+      //   the interleaved score/ID records, halving the cache footprint
+      //   of the scoring loop
+      void useScoreArrays(bool use = true) { m_score_arrays = use ; }
+      // find n-grams with an Aho-Corasick automaton built from the model,
+      //   visiting each input byte once; costs ten bytes per trie node
+      bool useMatcher(bool use = true) ;
+      // walk the trie for several starting positions in lockstep, so that
+      //   their cache misses overlap; a win for models larger than the cache
+      void useInterleavedLookups(bool use = true) { m_interleave = use ; }
       void runVerbosely(bool v) { m_verbose = v ; }
       void applyCoverageFactor(bool apply) { m_apply_cover_factor = apply ; }
       void incrStringCount(size_t langnum) ;
@@ -475,14 +618,24 @@ class LanguageIdentifier
    private:
       void setAlignments() ;
       bool setAdjustmentFactors() ;
+      void checkAlignments() ;
+      void checkLanguageIDs() const ;
+      void scanFrequencies() const ;
+      void setFrequencyWeights() const ;
+      void discardFrequencyWeights() ;
       static Fr::Owned<LanguageIdentifier> tryLoading(const char* db_file, bool verbose) ;
 
    private:
       Fr::Owned<LangIDPackedMultiTrie> m_langdata { nullptr } ;
       Fr::Owned<LangIDMultiTrie> m_uncomplangdata { nullptr } ;
-      mutable Fr::Owned<LanguageScores> m_prior_scores { nullptr } ;
+      Fr::Owned<PackedTrieMatcher> m_matcher { nullptr } ;
       Fr::ItemPoolFlat<LanguageID> m_langinfo ;
       Fr::DoublePtr          m_length_factors ;
+      mutable Fr::NewPtr<float> m_freq_weights ;
+      mutable std::atomic<bool> m_freqs_scanned { false } ;
+#ifndef FrSINGLE_THREADED
+      mutable std::mutex     m_scan_lock ;
+#endif /* !FrSINGLE_THREADED */
       Fr::DoublePtr          m_adjustments ;
       Fr::UInt8Ptr           m_alignments ;
       Fr::UInt8Ptr           m_unaligned ;
@@ -494,6 +647,58 @@ class LanguageIdentifier
       bool	             m_apply_cover_factor ;
       bool                   m_verbose ;
       bool		     m_smooth { true } ;
+      bool		     m_sparse_scores { false } ;
+      bool		     m_score_arrays { false } ;
+      bool		     m_interleave { false } ;
+      mutable bool	     m_ids_in_range { false } ;	// all IDs in database < numLanguages()
+      bool		     m_all_unaligned { false } ;	// every model has alignment 1
+   } ;
+
+//----------------------------------------------------------------------
+// incrementally scores a window which slides forward by a fixed step:
+//   the window is split into step-sized segments, and the contributions
+//   of each segment are kept in a ring so that advancing the window
+//   only requires scoring the newly-entered segment and the ngrams
+//   spanning its start, rather than rescoring the entire window
+
+class SlidingWindowScorer
+   {
+   public:
+      SlidingWindowScorer(const LanguageIdentifier *langid, size_t window, size_t step,
+			  bool apply_stop_grams = true, bool enforce_alignments = true) ;
+      SlidingWindowScorer(const SlidingWindowScorer&) = delete ;
+      ~SlidingWindowScorer() ;
+      SlidingWindowScorer& operator= (const SlidingWindowScorer&) = delete ;
+
+      // accessors
+      bool incremental() const { return m_segments > 0 ; }
+
+      // compute raw scores for 'buffer', which must either start exactly
+      //   'step' bytes after the previous call's buffer, or be preceded
+      //   by a call to reset(); returns an unfinished LanguageScores,
+      //   just like LanguageIdentifier::identify()
+      LanguageScores *identify(const char *buffer, size_t buflen) ;
+      void reset() ;
+
+   private:
+      LanguageScores *scoreSegment(const char *segment) const ;
+      void addSpanningNgrams(LanguageScores *scores, const char *segment) const ;
+      void pushSegment(LanguageScores *scores) ;
+
+   private:
+      const LanguageIdentifier*	m_langid ;
+      const uint8_t*		m_alignments ;
+      Fr::NewPtr<LanguageScores*> m_ring ;	// completed segments in window
+      Fr::Owned<LanguageScores>	m_ringsum { nullptr } ;
+      Fr::Owned<LanguageScores>	m_last { nullptr } ; // final segment, spanning ngrams omitted
+      size_t			m_window ;
+      size_t			m_step ;
+      size_t			m_segments ;	// 0 if unable to score incrementally
+      size_t			m_ringhead { 0 } ;
+      size_t			m_ringcount { 0 } ;
+      size_t			m_advances { 0 } ;
+      bool			m_stop_grams ;
+      bool			m_enforce_alignments ;
    } ;
 
 /************************************************************************/
@@ -501,6 +706,9 @@ class LanguageIdentifier
 /************************************************************************/
 
 double set_stopgram_penalty(double wt) ;
+// parse a -W weight specification such as "b0.2,s0.5"; 'b' sets the
+//   caller's bigram weight, 's' the global stop-gram penalty
+void parse_weights(const char *wtspec, double &bigram_weight) ;
 
 #endif /* !__LANGID_H_INCLUDED */
 
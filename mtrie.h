@@ -85,6 +85,8 @@ class MultiTrieFrequency
       void newFrequency(uint32_t ID, uint32_t freq, bool stopgram) ;
 
    private:
+      // shared by all multi-tries and not thread-safe; mklangid confines
+      //   all multi-trie updates to the thread owning the database
       static Fr::ItemPoolFlat<MultiTrieFrequency> s_freq_records ;
       uint32_t m_next ;
       uint32_t m_frequency ;
@@ -25,6 +25,7 @@
 /************************************************************************/
 
 #include "framepac/file.h"
+#include "framepac/mmapfile.h"
 #ifndef NO_ICONV
 # include <iconv.h>
 #endif
@@ -60,23 +61,30 @@ class PreprocessedInputFile
       PreprocessedInputFile(const char *filename, uint64_t sample_limit = s_sample_bytes,
 			    bool uniform_sample = s_sample_uniformly,
 			    const char *from_enc = s_from_enc, const char *to_enc = s_to_enc) ;
+      PreprocessedInputFile(const uint8_t *data, size_t datalen) ;
       ~PreprocessedInputFile() = default ;
 
       // accesse to state
-      bool good() const { return (bool)m_fp ; }
+      bool good() const { return (bool)m_fp || (bool)m_fmap || m_data ; }
+      const char *filename() const { return m_filename ; }
       bool ignoringWhitespace() const { return m_ignore_whitespace ; }
       BigramExtension bigramExt() const { return m_bigram_ext ; }
+      bool passthrough() const
+	 { return m_data || (!m_convert_Latin1 && m_bigram_ext == BigramExt_None && !m_ignore_whitespace) ; }
       uint64_t bytesRead() const { return m_bytes_read ; }
 
       bool open(const char *filename, uint64_t sample_limit = s_sample_bytes,
 		bool uniform_sample = s_sample_uniformly,
 		const char *from_enc = nullptr, const char *to_enc = nullptr) ;
+      bool open(const uint8_t *data, size_t datalen) ;
       void close() ;
 
       // input
       bool moreData() const ;
       int peekByte() ;
       int getByte() ;
+      size_t readSpan(const uint8_t *&span) ;
+      size_t readAll(Fr::NewPtr<uint8_t> &data) ;
 
       // configuration
       static void setSampling(uint64_t sample_limit, bool uniform_sample = true)
@@ -93,6 +101,15 @@ class PreprocessedInputFile
 
    protected:
       Fr::CFile* open_sampled_input_file(const char *filename, size_t max_bytes) ;
+      void sampleMappedLines(size_t max_bytes) ;
+      bool addSpan(size_t offset, size_t length) ;
+      size_t nextMappedSpan(const unsigned char *&span, size_t maxlen) ;
+      bool mappedDataRemaining() const
+	 { return m_next_span < m_num_spans || m_map_pos < m_fmap.size() ; }
+      size_t getSpan(const uint8_t *&span) ;
+      size_t stripWhitespace(uint8_t *buf, size_t buflen) ;
+      size_t expandLatin1(uint8_t *buf, size_t buflen) ;
+      size_t expandBigrams(uint8_t *buf, size_t buflen) ;
       bool initializeTransliteration(const char *from, const char *to) ;
       bool shutdownTransliteration() ;
       int readInput(unsigned char *buf, size_t buflen) ;
@@ -101,6 +118,13 @@ class PreprocessedInputFile
       int getFromBuffer() ;
       unsigned getCodepoint() ;
 
+   private:
+      class Span
+	 {
+	 public:
+	    size_t m_offset ;
+	    size_t m_length ;
+	 } ;
    private:
 #ifndef NO_ICONV
       iconv_t     m_conversion ;
@@ -108,6 +132,15 @@ class PreprocessedInputFile
 #endif /* !NO_ICONV */
       Fr::CharPtr m_filename ;
       Fr::CFile   m_fp ;
+      Fr::MemMappedFile m_fmap ;	// used instead of m_fp where possible
+      Fr::NewPtr<Span> m_spans ;	// sampled lines of m_fmap, in reading order
+      size_t	  m_num_spans ;
+      size_t	  m_alloc_spans ;
+      size_t	  m_next_span ;
+      size_t	  m_map_pos ;		// next byte of m_fmap after the sampled lines
+      const unsigned char *m_buffer ;	// translit_buffer or a span of m_fmap
+      const uint8_t *m_data ;		// replaying decoded input from memory?
+      size_t	  m_datalen ;
       Fr::List   *m_buffered_lines ;
       uint64_t	  m_bytes_read ;
       size_t	  m_max_sample_bytes ;
@@ -122,14 +155,17 @@ class PreprocessedInputFile
       bool	  m_convert_Latin1 ;
       bool        m_ignore_whitespace ;
       unsigned char translit_buffer[2*BUFFER_SIZE] ;
-      static Fr::CharPtr s_from_enc ;
-      static Fr::CharPtr s_to_enc ;
-      static uint64_t s_sample_bytes ;
-      static bool   s_sample_uniformly ;
-      static bool   s_convert_Latin1 ;
-      static bool   s_ignore_whitespace ;
-      static BigramExtension s_bigram_ext ;
-      static unsigned s_alignment ;
+      uint8_t	  span_buffer[BUFFER_SIZE] ;	// output of readSpan()
+      // the defaults are per-thread so that mklangid can train several
+      //   models with different settings at the same time
+      static thread_local Fr::CharPtr s_from_enc ;
+      static thread_local Fr::CharPtr s_to_enc ;
+      static thread_local uint64_t s_sample_bytes ;
+      static thread_local bool   s_sample_uniformly ;
+      static thread_local bool   s_convert_Latin1 ;
+      static thread_local bool   s_ignore_whitespace ;
+      static thread_local BigramExtension s_bigram_ext ;
+      static thread_local unsigned s_alignment ;
    } ;
 
 // end of file prepfile.h //
@@ -110,6 +110,7 @@ class PackedTrieFreq
       bool isStopgram() const { return (m_freqinfo.load() & TRIE_STOPGRAM) != 0 ; }
       const PackedTrieFreq *next() const { return isLast() ? nullptr : (this + 1) ; }
       static bool dataMappingInitialized() { return s_value_map_initialized ; }
+      static const double* dataMapping() { return s_value_map ; }
 
       // manipulators
       void isLast(bool last) ;
@@ -136,6 +137,9 @@ class PackedTrieTerminalNode
       bool leaf() const { return m_frequency_info.load() != INVALID_FREQ ; }
       const PackedTrieFreq *frequencies(const PackedTrieFreq *base) const
          { return base + m_frequency_info.load() ; }
+      // per-record values kept in an array parallel to the frequency records
+      template <typename T>
+      T *frequencyData(T *base) const { return base + m_frequency_info.load() ; }
 
       // modifiers
       void reinit() { setFrequencies(INVALID_FREQ) ; }
@@ -158,6 +162,9 @@ class PackedTrieNode : public PackedTrieTerminalNode
       uint32_t firstChild() const { return m_firstchild.load() ; }
       uint32_t childIndex(unsigned int N) const ;
       uint32_t childIndexIfPresent(unsigned int N) const ;
+      // bitmap of the children present for bytes 32*N to 32*N+31; the
+      //   children themselves are stored consecutively from firstChild()
+      uint32_t childMask(unsigned int N) const { return m_children[N].load() ; }
 
       // modifiers
       void setFirstChild(uint32_t index) { m_firstchild.store(index) ; }
@@ -168,6 +175,9 @@ class PackedTrieNode : public PackedTrieTerminalNode
       Fr::UInt32 m_firstchild { 0 } ;
       Fr::UInt32 m_children[LENGTHOF_M_CHILDREN] { 0 } ;
       uint8_t	 m_popcounts[LENGTHOF_M_CHILDREN] { 0 } ;
+      // pad the node to a full cache line, so that a lookup in a
+      //   cache-aligned node array never touches two lines
+      uint8_t	 m_padding[16] { 0 } ;
    } ;
 
 //----------------------------------------------------------------------
@@ -183,6 +193,14 @@ enum PTrieCase
       CS_Latin1
    } ;
 
+// how a trie loaded from a file is brought into memory
+enum PTrieLoadMode
+   {
+      PL_Mapped = 0,	// memory-map the file and demand-page it
+      PL_Prefault,	// memory-map the file and fault it all in at load time
+      PL_HugePages	// copy the data into an arena backed by huge pages
+   } ;
+
 class LangIDPackedMultiTrie // : public Fr::PackedMultiTrie<...>
    {
    public:
@@ -193,26 +211,41 @@ class LangIDPackedMultiTrie // : public Fr::PackedMultiTrie<...>
 
       // how do we distinguish non-terminal from terminal nodes?
       static constexpr uint32_t TERMINAL_MASK = 0x80000000 ;
+      // the first two levels of the trie are flattened into a direct-lookup
+      //   table indexed by the first two bytes of the key
+      static constexpr unsigned ROOT_TABLE_SIZE = (1U << (2*PTRIE_BITS_PER_LEVEL)) ;
    public:
       LangIDPackedMultiTrie() = default ;
       LangIDPackedMultiTrie(const LangIDMultiTrie *trie) ;
       LangIDPackedMultiTrie(Fr::CFile& f, const char *filename) ;
-      ~LangIDPackedMultiTrie() = default ;
+      ~LangIDPackedMultiTrie() ;
 
-      bool parseHeader(Fr::CFile& f, size_t& numfull, size_t& numfreq, size_t& numterminals) ;
+      bool parseHeader(Fr::CFile& f, size_t& numfull, size_t& numfreq, size_t& numterminals,
+		       unsigned *version = nullptr) ;
 
       // modifiers
       void ignoreWhiteSpace(bool ignore = true) { m_ignorewhitespace = ignore ; }
       void caseSensitivity(PTrieCase cs) { m_casesensitivity = cs ; }
+      // applies to tries loaded after the call
+      static void loadMode(PTrieLoadMode mode) { s_load_mode = mode ; }
+      // whether tries loaded or packed after the call build the 256KB
+      //   two-byte root table, or walk the first two levels of the trie
+      static void useRootTable(bool use) { s_use_roottable = use ; }
 
       // accessors
       bool good() const { return size() > 0 && m_freq.size() ; }
       static bool terminalNode(uint32_t nodeindex) { return (nodeindex & TERMINAL_MASK) != 0 ; }
       uint32_t size() const { return m_nodes.size() ; }
+      uint32_t numTerminals() const { return m_terminals.size() ; }
       uint32_t numFrequencies() const { return m_freq.size(); }
       unsigned longestKey() const { return m_maxkeylen ; }
       bool ignoringWhiteSpace() const { return m_ignorewhitespace ; }
       PTrieCase caseSensitivity() const { return m_casesensitivity ; }
+      static PTrieLoadMode loadMode() { return s_load_mode ; }
+      // describes how the trie's data was actually brought into memory
+      const char *residency() const { return m_residency ; }
+      // whether the trie's data is brought in page by page as it is used
+      bool demandPaged() const { return m_demand_paged ; }
       const PackedTrieFreq* frequencyBaseAddress() const { return m_freq.item(0) ; }
       PackedTrieNode* node(uint32_t N) const
 	 { if ((N & TERMINAL_MASK) != 0)
@@ -226,6 +259,18 @@ class LangIDPackedMultiTrie // : public Fr::PackedMultiTrie<...>
       PackedTrieNode *findNode(const uint8_t *key, unsigned keylength) const ;
       bool extendKey(uint32_t &nodeindex, uint8_t keybyte) const ;
       uint32_t extendKey(uint8_t keybyte, uint32_t nodeindex) const ;
+      // equivalent to extendKey(byte2,extendKey(byte1,ROOT_INDEX)), but with
+      //   a single memory access instead of two node lookups if the root
+      //   table is available
+      uint32_t extendRoot(uint8_t byte1, uint8_t byte2) const
+	 { if (m_roottable)
+	      return m_roottable[(byte1 << PTRIE_BITS_PER_LEVEL) | byte2] ;
+	   uint32_t child = extendKey(byte1,ROOT_INDEX) ;
+	   return (child == NULL_INDEX) ? NULL_INDEX : extendKey(byte2,child) ;
+	 }
+      bool hasRootTable() const { return m_roottable.get() != nullptr ; }
+      const uint32_t* rootTableEntry(uint8_t byte1, uint8_t byte2) const
+	 { return m_roottable ? &m_roottable[(byte1 << PTRIE_BITS_PER_LEVEL) | byte2] : nullptr ; }
       bool enumerate(uint8_t *keybuf, unsigned maxkeylength,
 		     EnumFn *fn, void *user_data) const ;
       bool enumerateChildren(uint32_t nodeindex,
@@ -241,26 +286,96 @@ class LangIDPackedMultiTrie // : public Fr::PackedMultiTrie<...>
       bool dump(Fr::CFile& f) const ;
    private:
       bool writeHeader(Fr::CFile& f) const ;
+      const char *residentData(const char *mapped, size_t datasize) ;
+      void buildRootTable() ;
       uint32_t allocateChildNodes(unsigned numchildren) ;
       uint32_t allocateTerminalNodes(unsigned numchildren) ;
-      bool insertChildren(PackedTrieNode *parent, const LangIDMultiTrie *mtrie,
-			  uint32_t mnode_index, unsigned keylen = 0) ;
+      bool insertChildren(uint32_t parent_index, const LangIDMultiTrie *mtrie,
+			  uint32_t mnode_index, unsigned keylen,
+			  uint32_t *mnode_indices, uint8_t *keylens) ;
+      bool loadUnpaddedNodes(Fr::CFile& f, size_t numfull) ;
       bool insertTerminals(PackedTrieNode *parent, const LangIDMultiTrie *mtrie,
 			   uint32_t mnode_index, unsigned keylen = 0) ;
    private:
       Fr::ItemPool<PackedTrieNode> m_nodes ;
       Fr::ItemPool<PackedTrieTerminalNode> m_terminals ;
       Fr::ItemPoolFlat<PackedTrieFreq> m_freq ;
+      Fr::NewPtr<uint32_t> m_roottable ; // node index for each two-byte prefix
       Fr::MemMappedFile	 m_fmap ;	 // memory-map info
+      char		*m_arena            { nullptr } ; // huge-page copy of the mapped data
+      size_t		 m_arena_size       { 0 } ;
+      const char	*m_residency        { "built in memory" } ;
+      bool		 m_demand_paged     { false } ;
       unsigned		 m_maxkeylen        { 0 } ;
       enum PTrieCase	 m_casesensitivity  { CS_Full } ;
       bool		 m_ignorewhitespace { false } ;
+      static PTrieLoadMode s_load_mode ;
+      static bool	   s_use_roottable ;
    } ;
 
 //----------------------------------------------------------------------
 
 typedef TriePointer<LangIDPackedMultiTrie> PackedMultiTriePointer ;
 
+//----------------------------------------------------------------------
+// an Aho-Corasick automaton over a packed trie: each node gets a failure
+//   link to the node for its longest proper suffix which is also in the
+//   trie, and an output link to the longest proper suffix which is a
+//   leaf, so that every key occurring in a buffer can be found in a
+//   single pass instead of restarting at the root for each position.
+//   The automaton's states are simply the trie's node indices.
+
+class PackedTrieMatcher
+   {
+   public:
+      static constexpr uint32_t ROOT_INDEX = LangIDPackedMultiTrie::ROOT_INDEX ;
+      static constexpr uint32_t NO_OUTPUT = LangIDPackedMultiTrie::ROOT_INDEX ;
+   public:
+      PackedTrieMatcher(const LangIDPackedMultiTrie *trie) ;
+      PackedTrieMatcher(const PackedTrieMatcher&) = delete ;
+      ~PackedTrieMatcher() = default ;
+      PackedTrieMatcher& operator= (const PackedTrieMatcher&) = delete ;
+
+      // accessors
+      bool good() const { return m_trie && m_fail && m_output && m_keylen ; }
+      const LangIDPackedMultiTrie *trie() const { return m_trie ; }
+      unsigned longestKey() const { return m_trie->longestKey() ; }
+      unsigned keyLength(uint32_t state) const { return m_keylen[slot(state)] ; }
+      // the longest key ending in the given state which is a leaf (the
+      //   state itself if it is a leaf), or NO_OUTPUT
+      uint32_t firstOutput(uint32_t state) const
+	 { return m_trie->node(state)->leaf() ? state : m_output[slot(state)] ; }
+      // the next-longest leaf key which is a suffix of the given leaf
+      uint32_t nextOutput(uint32_t state) const { return m_output[slot(state)] ; }
+
+      // the state reached by consuming 'keybyte' in the given state
+      uint32_t advance(uint32_t state, uint8_t keybyte) const
+	 {
+	    for ( ; ; )
+	       {
+	       uint32_t next = m_trie->extendKey(keybyte,state) ;
+	       if (next != LangIDPackedMultiTrie::NULL_INDEX)
+		  return next ;
+	       if (state == ROOT_INDEX)
+		  return ROOT_INDEX ;
+	       state = m_fail[slot(state)] ;
+	       }
+	 }
+
+   private:
+      // terminal nodes are numbered after all of the full nodes
+      uint32_t slot(uint32_t nodeindex) const
+	 { return LangIDPackedMultiTrie::terminalNode(nodeindex)
+	       ? m_numnodes + (nodeindex & ~LangIDPackedMultiTrie::TERMINAL_MASK) : nodeindex ; }
+
+   private:
+      const LangIDPackedMultiTrie *m_trie ;
+      Fr::NewPtr<uint32_t>	   m_fail ;	// failure link for each node
+      Fr::NewPtr<uint32_t>	   m_output ;	// output link for each node
+      Fr::NewPtr<uint16_t>	   m_keylen ;	// depth of each node
+      uint32_t			   m_numnodes ;
+   } ;
+
 #endif /* !__PTRIE_H_INCLUDED */
 
 /* end of file ptrie.h */
@@ -28,6 +28,7 @@
 
 #include <cstdint>
 #include <limits.h>
+#include <vector>
 #include "framepac/file.h"
 #include "framepac/itempool.h"
 
@@ -39,10 +40,15 @@ using namespace std ;
 
 // we can trade off speed for memory by adjusting how many bits each
 //   node in the trie represents.  Current supported values are 2, 3,
-//   and 4; two bits per node uses about 60% as much total memory as 4
+//   4, and 8; two bits per node uses about 60% as much total memory as 4
 //   bits, but needs twice as many memory accesses for lookups; three bits
-//   is in-between
-#define BITS_PER_LEVEL 2
+//   is in-between.  Eight bits needs only one access per byte, but each
+//   node is over 1K, so it only pays off for training on machines with
+//   lots of memory.  The value may be overridden at build time (see the
+//   'wide' target in the makefile), but all modules must agree on it.
+#ifndef BITS_PER_LEVEL
+#  define BITS_PER_LEVEL 2
+#endif
 
 // we want to store percentages for entries in the trie in 32 bits.  Since
 //   it is very unlikely that any ngram in the trie will have a probability
@@ -80,6 +86,7 @@ class NybbleTrieNode
       void scaleFrequency(uint64_t total_count) ;
       void scaleFrequency(uint64_t total_count, double power, double log_power) ;
       uint32_t insertChild(unsigned int N, NybbleTrie *trie) ;
+      void removeChild(unsigned int N) { m_children[N] = 0 ; }
 
       // I/O
       static NybbleTrieNode *read(Fr::CFile& f) ;
@@ -110,7 +117,14 @@ class NybbleTrie
       ~NybbleTrie() = default ;
 
       bool loadWords(const char *filename, LoadFn* insfn, uint32_t langID, bool verbose) ;
-      NodeIndex allocateNode() { return (NodeIndex)m_nodes.alloc() ; }
+      NodeIndex allocateNode()
+	 {
+	    if (m_freenodes.empty())
+	       return (NodeIndex)m_nodes.alloc() ;
+	    NodeIndex idx = m_freenodes.back() ;
+	    m_freenodes.pop_back() ;
+	    return idx ;
+	 }
 
       // modifiers
       void setUserData(void *ud) { m_userdata = ud ; }
@@ -123,11 +137,17 @@ class NybbleTrie
       uint32_t increment(const uint8_t *key, unsigned keylength, uint32_t incr = 1, bool stopgram = false) ;
       bool incrementExtensions(const uint8_t *key, unsigned prevlength,
 			       unsigned keylength, uint32_t incr = 1) ;
+      bool incrementExtensions(NodeIndex prefix, const uint8_t *key, unsigned prevlength,
+			       unsigned keylength, uint32_t incr = 1) ;
+      size_t prune(unsigned protected_keylen, uint32_t min_freq) ;
+      size_t protectedNodes(unsigned protected_keylen) const
+	 { return countProtectedNodes(ROOT_INDEX,8*protected_keylen) ; }
 
       // accessors
       void *userData() const { return m_userdata ; }
       uint32_t size() const { return m_nodes.size() ; }
       uint32_t capacity() const { return m_nodes.capacity() ; }
+      uint32_t liveNodes() const { return size() - m_freenodes.size() ; }
       uint32_t totalTokens() const { return m_totaltokens ; }
       unsigned longestKey() const { return m_maxkeylen ; }
       bool ignoringWhiteSpace() const { return m_ignorewhitespace ; }
@@ -161,8 +181,14 @@ class NybbleTrie
       bool extendNybble(NodeIndex& nodeindex, uint8_t nybble) const ;
       size_t countTerminalNodes(NodeIndex nodeindex, uint32_t min_freq, unsigned keylen_bits = 0) const ;
       size_t countFullByteNodes(NodeIndex nodeindex, uint32_t min_freq, unsigned keylen_bits = 0) const ;
+      bool pruneChildren(NodeIndex nodeindex, unsigned keylen_bits, unsigned protected_bits,
+			 uint32_t min_freq, size_t &freed) ;
+      size_t countProtectedNodes(NodeIndex nodeindex, unsigned protected_bits,
+				 unsigned keylen_bits = 0) const ;
+      void releaseNode(NodeIndex nodeindex) ;
    protected:
       Fr::ItemPool<Node> m_nodes ;
+      std::vector<NodeIndex> m_freenodes ;	// nodes released by prune()
       void	       *m_userdata ;
       uint32_t	 	m_totaltokens ;
       unsigned	 	m_maxkeylen ;